@@ -22,17 +22,38 @@
 // SOFTWARE.
 
 #include <cassert>
+#include <cerrno>
+#include <climits>
 #include <cstddef>
 #include <cstdint>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
 
+#include <algorithm>
 #include <array>
 #include <sax/iostream.hpp>
 #include <iterator>
+#include <limits>
 #include <random>
+#include <string>
+#include <string_view>
 #include <type_traits>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#    include <io.h>
+#    ifndef NOMINMAX
+#        define NOMINMAX
+#    endif
+#    include <windows.h>
+#else
+#    include <sys/uio.h>
+#    include <unistd.h>
+#endif
+
 #include <benchmark/benchmark.h>
 
 #ifdef _WIN32
@@ -106,6 +127,250 @@ struct storage {
 #undef MALLOC
 #undef FREE
 
+namespace detail {
+#ifdef _WIN32
+struct iovec {
+    void * iov_base;
+    std::size_t iov_len;
+};
+#else
+using iovec = ::iovec;
+#endif
+
+#ifdef _WIN32
+// There is no writev/readv, the io-vector is gathered into (scattered from) a staging buffer
+// of this size, which is written (read) with as few _write (_read) calls as possible.
+inline constexpr std::size_t staging_size = std::size_t{ 1 } << 22;
+
+[[nodiscard]] inline bool write_buffer ( int fd_, char const * data_, std::size_t size_ ) noexcept {
+    while ( size_ ) {
+        int const n = ::_write ( fd_, data_, static_cast<unsigned> ( std::min<std::size_t> ( size_, INT_MAX ) ) );
+        if ( n <= 0 )
+            return false;
+        data_ += n;
+        size_ -= static_cast<std::size_t> ( n );
+    }
+    return true;
+}
+
+[[nodiscard]] inline bool read_buffer ( int fd_, char * data_, std::size_t size_ ) noexcept {
+    while ( size_ ) {
+        int const n = ::_read ( fd_, data_, static_cast<unsigned> ( std::min<std::size_t> ( size_, INT_MAX ) ) );
+        if ( n <= 0 )
+            return false;
+        data_ += n;
+        size_ -= static_cast<std::size_t> ( n );
+    }
+    return true;
+}
+
+[[nodiscard]] inline std::size_t total_size ( iovec const * iov_, std::size_t iovcnt_ ) noexcept {
+    std::size_t size = 0u;
+    for ( std::size_t i = 0u; i < iovcnt_; ++i )
+        size += iov_[ i ].iov_len;
+    return size;
+}
+
+// Gathered write of the whole io-vector.
+[[nodiscard]] inline bool write_all ( int fd_, iovec * iov_, std::size_t iovcnt_ ) noexcept {
+    std::vector<char> staging ( std::min ( total_size ( iov_, iovcnt_ ), staging_size ) );
+    std::size_t fill = 0u;
+    for ( std::size_t i = 0u; i < iovcnt_; ++i ) {
+        char const * data = static_cast<char const *> ( iov_[ i ].iov_base );
+        std::size_t size  = iov_[ i ].iov_len;
+        while ( size ) {
+            std::size_t const c = std::min ( size, staging.size ( ) - fill );
+            std::memcpy ( staging.data ( ) + fill, data, c );
+            fill += c, data += c, size -= c;
+            if ( staging.size ( ) == fill ) {
+                if ( not write_buffer ( fd_, staging.data ( ), fill ) )
+                    return false;
+                fill = 0u;
+            }
+        }
+    }
+    return write_buffer ( fd_, staging.data ( ), fill );
+}
+
+// Scattered read of the whole io-vector, a premature end-of-file is an error.
+[[nodiscard]] inline bool read_all ( int fd_, iovec * iov_, std::size_t iovcnt_ ) noexcept {
+    std::size_t remaining = total_size ( iov_, iovcnt_ );
+    std::vector<char> staging ( std::min ( remaining, staging_size ) );
+    std::size_t position = 0u, fill = 0u;
+    for ( std::size_t i = 0u; i < iovcnt_; ++i ) {
+        char * data      = static_cast<char *> ( iov_[ i ].iov_base );
+        std::size_t size = iov_[ i ].iov_len;
+        while ( size ) {
+            if ( fill == position ) {
+                fill = std::min ( remaining, staging.size ( ) );
+                if ( not read_buffer ( fd_, staging.data ( ), fill ) )
+                    return false;
+                remaining -= fill, position = 0u;
+            }
+            std::size_t const c = std::min ( size, fill - position );
+            std::memcpy ( data, staging.data ( ) + position, c );
+            position += c, data += c, size -= c;
+        }
+    }
+    return true;
+}
+#else
+#    ifdef IOV_MAX
+inline constexpr std::size_t iov_max = IOV_MAX;
+#    else
+inline constexpr std::size_t iov_max = 1'024;
+#    endif
+
+// Drops the first n_ bytes from the io-vector, returns the number of exhausted entries.
+[[nodiscard]] inline std::size_t consume ( iovec * iov_, std::size_t iovcnt_, std::size_t n_ ) noexcept {
+    std::size_t i = 0u;
+    for ( ; i < iovcnt_ and n_ >= iov_[ i ].iov_len; ++i )
+        n_ -= iov_[ i ].iov_len;
+    if ( i < iovcnt_ ) {
+        iov_[ i ].iov_base = static_cast<char *> ( iov_[ i ].iov_base ) + n_;
+        iov_[ i ].iov_len -= n_;
+    }
+    return i;
+}
+
+// Gathered write of the whole io-vector, up to iov_max entries per writev, retries on short
+// writes and EINTR.
+[[nodiscard]] inline bool write_all ( int fd_, iovec * iov_, std::size_t iovcnt_ ) noexcept {
+    while ( iovcnt_ ) {
+        if ( not iov_->iov_len ) {
+            ++iov_, --iovcnt_;
+            continue;
+        }
+        ssize_t const n = ::writev ( fd_, iov_, static_cast<int> ( std::min ( iovcnt_, iov_max ) ) );
+        if ( n < 0 ) {
+            if ( EINTR == errno )
+                continue;
+            return false;
+        }
+        if ( not n )
+            return false;
+        std::size_t const c = consume ( iov_, iovcnt_, static_cast<std::size_t> ( n ) );
+        iov_ += c, iovcnt_ -= c;
+    }
+    return true;
+}
+
+// Scattered read of the whole io-vector, up to iov_max entries per readv, a premature
+// end-of-file is an error.
+[[nodiscard]] inline bool read_all ( int fd_, iovec * iov_, std::size_t iovcnt_ ) noexcept {
+    while ( iovcnt_ ) {
+        if ( not iov_->iov_len ) {
+            ++iov_, --iovcnt_;
+            continue;
+        }
+        ssize_t const n = ::readv ( fd_, iov_, static_cast<int> ( std::min ( iovcnt_, iov_max ) ) );
+        if ( n < 0 ) {
+            if ( EINTR == errno )
+                continue;
+            return false;
+        }
+        if ( not n )
+            return false;
+        std::size_t const c = consume ( iov_, iovcnt_, static_cast<std::size_t> ( n ) );
+        iov_ += c, iovcnt_ -= c;
+    }
+    return true;
+}
+#endif
+
+[[nodiscard]] inline int open_for_write ( char const * path_ ) noexcept {
+#ifdef _WIN32
+    return ::_open ( path_, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE );
+#else
+    return ::open ( path_, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+#endif
+}
+
+[[nodiscard]] inline int open_for_read ( char const * path_ ) noexcept {
+#ifdef _WIN32
+    return ::_open ( path_, _O_RDONLY | _O_BINARY );
+#else
+    return ::open ( path_, O_RDONLY );
+#endif
+}
+
+// Bytes left in the file from the current offset, -1 if the fd is not a (seekable) regular file.
+[[nodiscard]] inline std::int64_t remaining_size ( int fd_ ) noexcept {
+#ifdef _WIN32
+    struct ::_stat64 st;
+    if ( ::_fstat64 ( fd_, &st ) or not( st.st_mode & _S_IFREG ) )
+        return -1;
+    std::int64_t const offset = ::_lseeki64 ( fd_, 0, SEEK_CUR );
+#else
+    struct ::stat st;
+    if ( ::fstat ( fd_, &st ) or not S_ISREG ( st.st_mode ) )
+        return -1;
+    std::int64_t const offset = ::lseek ( fd_, 0, SEEK_CUR );
+#endif
+    if ( offset < 0 or offset > st.st_size )
+        return -1;
+    return st.st_size - offset;
+}
+
+inline int close ( int fd_ ) noexcept {
+#ifdef _WIN32
+    return ::_close ( fd_ );
+#else
+    return ::close ( fd_ );
+#endif
+}
+
+// Flushes the file to stable storage.
+[[nodiscard]] inline bool sync ( int fd_ ) noexcept {
+#ifdef _WIN32
+    return 0 == ::_commit ( fd_ );
+#else
+    return 0 == ::fsync ( fd_ );
+#endif
+}
+
+// Atomically replaces to_ by from_ (both in the same directory), and makes the rename durable.
+[[nodiscard]] inline bool replace ( char const * from_, char const * to_ ) noexcept {
+#ifdef _WIN32
+    return 0 != ::MoveFileExA ( from_, to_, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH );
+#else
+    if ( ::rename ( from_, to_ ) )
+        return false;
+    std::string_view const path{ to_ };
+    std::size_t const slash = path.find_last_of ( '/' );
+    std::string const directory{ std::string_view::npos == slash ? std::string_view{ "." }
+                                                                 : path.substr ( 0u, slash ? slash : 1u ) };
+    int const fd = ::open ( directory.c_str ( ), O_RDONLY | O_DIRECTORY );
+    if ( fd < 0 )
+        return false;
+    bool const r = sync ( fd );
+    return ( 0 == close ( fd ) ) and r;
+#endif
+}
+
+inline void remove ( char const * path_ ) noexcept {
+#ifdef _WIN32
+    ::_unlink ( path_ );
+#else
+    ::unlink ( path_ );
+#endif
+}
+
+// Leads a queue snapshot, the payload are the live elements in fifo order.
+struct snapshot_header {
+    static constexpr std::uint64_t magic_value = 0x504E'5345'5545'5551ull; // "QUEUESNP" in little-endian.
+    static constexpr std::uint32_t version_value = 1u;
+
+    std::uint64_t magic;
+    std::uint32_t version, value_size;
+    std::uint64_t block_size, size;
+};
+
+// Storage for a snapshot payload is laid out (and read into) this many bytes at a time,
+// a stream that ends early never leaves more than this much storage behind.
+inline constexpr std::size_t load_chunk_size = std::size_t{ 1 } << 22;
+} // namespace detail
+
 template<typename Type, std::size_t Size = 16u>
 class queue {
 
@@ -127,6 +392,28 @@ class queue {
     storage_pointer storage_head, storage_tail;
     pointer head, tail;
 
+    // Frees all storage after the given storage.
+    static void release_storage_after ( storage_pointer storage_ ) noexcept {
+        storage_pointer ptr = storage_->next;
+        storage_->next      = nullptr;
+        while ( ptr ) {
+            storage_pointer tmp = ptr->next;
+            storage::operator delete ( reinterpret_cast<void *> ( ptr ) );
+            ptr = tmp;
+        }
+    }
+
+    // Moves the tail to the next (spare or new) storage, iff the current one is full.
+    void advance_storage_tail ( ) noexcept {
+        if ( ( storage_tail->data ( ) + Size ) == tail ) {
+            if ( storage_tail->next )
+                storage_tail = storage_tail->next;
+            else
+                storage_tail = ( storage_tail->next = storage::make ( ) );
+            tail = storage_tail->data ( );
+        }
+    }
+
     public:
     queue ( ) noexcept :
         storage_head{ storage::make ( ) }, storage_tail{ storage_head }, head{ storage_head->data ( ) }, tail{ head } {}
@@ -141,13 +428,7 @@ class queue {
 
     template<typename... Args>
     void emplace ( Args &&... args_ ) noexcept {
-        if ( ( storage_tail->data ( ) + Size ) == tail ) {
-            if ( storage_tail->next )
-                storage_tail = storage_tail->next;
-            else
-                storage_tail = ( storage_tail->next = storage::make ( ) );
-            tail = storage_tail->data ( );
-        }
+        advance_storage_tail ( );
         *tail++ = { std::forward<Args> ( args_ )... };
     }
 
@@ -173,6 +454,101 @@ class queue {
 
     [[nodiscard]] bool empty ( ) const noexcept { return head == tail; }
 
+    // Empties the queue, all storage is kept as spare storage.
+    void clear ( ) noexcept {
+        storage_tail = storage_head;
+        head = tail = storage_head->data ( );
+    }
+
+    // Snapshots, a header followed by the live elements in fifo order. The live segments
+    // of the storage blocks are written (and read back) in place by batched writev (readv),
+    // up to IOV_MAX segments per call, on Windows through a staging buffer. Return false on
+    // failure, in which case a loaded queue is left empty.
+
+    [[nodiscard]] bool save ( int fd_ ) const noexcept {
+        static_assert ( std::is_trivially_copyable<value_type>::value, "snapshots require a trivially copyable value_type" );
+        detail::snapshot_header header{ detail::snapshot_header::magic_value, detail::snapshot_header::version_value,
+                                        static_cast<std::uint32_t> ( sizeof ( value_type ) ), Size, 0u };
+        std::vector<detail::iovec> iov;
+        iov.push_back ( { &header, sizeof ( header ) } );
+        storage_pointer ptr = storage_head;
+        pointer curr        = head;
+        while ( ptr != storage_tail ) {
+            size_type const n = static_cast<size_type> ( ( ptr->data ( ) + Size ) - curr );
+            iov.push_back ( { curr, n * sizeof ( value_type ) } );
+            header.size += n;
+            ptr  = ptr->next;
+            curr = ptr->data ( );
+        }
+        size_type const n = static_cast<size_type> ( tail - curr );
+        iov.push_back ( { curr, n * sizeof ( value_type ) } );
+        header.size += n;
+        return detail::write_all ( fd_, iov.data ( ), iov.size ( ) );
+    }
+
+    // Checkpoints are written to a sibling temporary file, synced and then renamed over path_,
+    // a failure at any point leaves the previous snapshot at path_ intact.
+    [[nodiscard]] bool save ( char const * path_ ) const noexcept {
+        std::string const temporary = std::string{ path_ } + ".tmp";
+        int const fd                = detail::open_for_write ( temporary.c_str ( ) );
+        if ( fd < 0 )
+            return false;
+        bool r = save ( fd ) and detail::sync ( fd );
+        r      = ( 0 == detail::close ( fd ) ) and r;
+        if ( r and detail::replace ( temporary.c_str ( ), path_ ) )
+            return true;
+        detail::remove ( temporary.c_str ( ) );
+        return false;
+    }
+
+    // Replaces the contents of the queue, spare storage is re-used before new storage is made.
+    // The element count is checked against the file size (if the fd is a regular file) before
+    // anything is allocated, on failure any storage made by load is freed again.
+    [[nodiscard]] bool load ( int fd_ ) noexcept {
+        static_assert ( std::is_trivially_copyable<value_type>::value, "snapshots require a trivially copyable value_type" );
+        clear ( );
+        detail::snapshot_header header;
+        detail::iovec header_iov{ &header, sizeof ( header ) };
+        if ( not detail::read_all ( fd_, &header_iov, 1u ) or detail::snapshot_header::magic_value != header.magic or
+             detail::snapshot_header::version_value != header.version or sizeof ( value_type ) != header.value_size or
+             Size != header.block_size or std::numeric_limits<std::uint64_t>::max ( ) / sizeof ( value_type ) < header.size )
+            return false;
+        if ( std::int64_t const remaining = detail::remaining_size ( fd_ );
+             remaining >= 0 and static_cast<std::uint64_t> ( remaining ) != header.size * sizeof ( value_type ) )
+            return false;
+        storage_pointer last = storage_head;
+        while ( last->next )
+            last = last->next;
+        std::vector<detail::iovec> iov;
+        for ( std::uint64_t n = header.size; n; ) {
+            iov.clear ( );
+            for ( size_type bytes = 0u; n and bytes < detail::load_chunk_size; ) {
+                advance_storage_tail ( );
+                size_type const c = static_cast<size_type> (
+                    std::min<std::uint64_t> ( n, static_cast<std::uint64_t> ( ( storage_tail->data ( ) + Size ) - tail ) ) );
+                iov.push_back ( { tail, c * sizeof ( value_type ) } );
+                bytes += c * sizeof ( value_type );
+                tail += c;
+                n -= c;
+            }
+            if ( not detail::read_all ( fd_, iov.data ( ), iov.size ( ) ) ) {
+                clear ( );
+                release_storage_after ( last );
+                return false;
+            }
+        }
+        return true;
+    }
+
+    [[nodiscard]] bool load ( char const * path_ ) noexcept {
+        int const fd = detail::open_for_read ( path_ );
+        if ( fd < 0 )
+            return false;
+        bool const r = load ( fd );
+        detail::close ( fd );
+        return r;
+    }
+
     void print_head_tail ( ) const noexcept { std::cout << "head " << head << " tail " << tail << nl; }
 
     void print_storage_pointers ( ) const noexcept {
@@ -346,6 +722,28 @@ class experiment {
 
 int main ( ) {
 
+    // Snapshot round-trip, r holds spare storage before the load.
+
+    queue<int, 4> s, r;
+
+    for ( int i = 0; i < 19; ++i )
+        s.emplace ( i );
+    for ( int i = 0; i < 5; ++i )
+        s.pop ( );
+
+    for ( int i = 0; i < 13; ++i )
+        r.emplace ( -i );
+    for ( int i = 0; i < 6; ++i )
+        r.pop ( );
+
+    if ( not s.save ( "queue.snapshot" ) or not r.load ( "queue.snapshot" ) ) {
+        std::cout << "snapshot round-trip failed" << nl;
+        return EXIT_FAILURE;
+    }
+
+    r.print_storage_pointers ( );
+    std::cout << nl << s << nl << r << nl;
+
     queue<int, 4> q;
 
     q.print_head_tail ( );